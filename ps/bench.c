@@ -0,0 +1,447 @@
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ps.h"
+
+// ps_bench links main.c with -Wl,--wrap=... (see CMakeLists.txt), so every
+// call ps makes through these functions is counted here. Calls libc makes
+// internally are not visible to the wrapper: getdents() inside readdir(),
+// the open() of opendir() and the write() of stdio output. readdir() calls
+// are reported on their own instead.
+struct syscall_counters {
+    long long openat;
+    long long read;
+    long long close;
+    long long fstatat;
+    long long readlink;
+    long long readdir;
+};
+
+static struct syscall_counters counters;
+
+int __real_openat(int dir_fd, const char* path, int flags, ...);
+ssize_t __real_read(int fd, void* buf, size_t count);
+int __real_close(int fd);
+int __real_fstatat(int dir_fd, const char* path, struct stat* buf, int flags);
+ssize_t __real_readlink(const char* path, char* buf, size_t size);
+struct dirent* __real_readdir(DIR* dir);
+
+int __wrap_openat(int dir_fd, const char* path, int flags, ...) {
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    ++counters.openat;
+    return __real_openat(dir_fd, path, flags, mode);
+}
+
+ssize_t __wrap_read(int fd, void* buf, size_t count) {
+    ++counters.read;
+    return __real_read(fd, buf, count);
+}
+
+int __wrap_close(int fd) {
+    ++counters.close;
+    return __real_close(fd);
+}
+
+int __wrap_fstatat(int dir_fd, const char* path, struct stat* buf, int flags) {
+    ++counters.fstatat;
+    return __real_fstatat(dir_fd, path, buf, flags);
+}
+
+ssize_t __wrap_readlink(const char* path, char* buf, size_t size) {
+    ++counters.readlink;
+    return __real_readlink(path, buf, size);
+}
+
+// while vanish_fd is set, every VANISH_EVERY-th pid (shifted by vanish_phase)
+// is removed right after readdir() returns it, so ps sees the entry and then
+// loses the readdir() -> openat() race as with a process exiting mid-scan.
+// The removed pids are kept in vanished_pids and recreated after the scan.
+#define VANISH_EVERY 200
+
+static int vanish_fd = -1;
+static int vanish_phase = 0;
+static long long vanished = 0;
+static double vanish_seconds = 0;
+static int* vanished_pids = NULL;
+static size_t vanished_count = 0;
+static size_t vanished_capacity = 0;
+
+void remove_process(int root_fd, int pid);
+double now(void);
+
+struct dirent* __wrap_readdir(DIR* dir) {
+    ++counters.readdir;
+    struct dirent* ent = __real_readdir(dir);
+    if (ent && vanish_fd != -1) {
+        int pid = atoi(ent->d_name);
+        if (pid > 0 && pid % VANISH_EVERY == vanish_phase) {
+            double begin = now();
+            if (vanished_count == vanished_capacity) {
+                vanished_capacity = vanished_capacity ? 2 * vanished_capacity : 256;
+                vanished_pids = realloc(vanished_pids, vanished_capacity * sizeof(int));
+                if (!vanished_pids) {
+                    printf("ps_bench: memory exhausted\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            vanished_pids[vanished_count++] = pid;
+            remove_process(vanish_fd, pid);
+            vanish_seconds += now() - begin;
+            ++vanished;
+        }
+    }
+    return ent;
+}
+
+struct bench_params {
+    char root[PATH_MAX];
+    int count;
+    int refreshes;
+    int keep;
+};
+
+// names real kernels produce plus the ones that break naive parsers
+static const char* const comms[] = {
+        "bash",
+        "systemd",
+        "kworker/0:1-events",
+        "Web Content",
+        "(sd-pam)",
+        "x) S 1 (y",
+        "",
+        "tab\tname",
+        "a_command_name_far_longer_than_task_comm_len",
+        "\xd1\x84\xd0\xb0\xd0\xb9\xd0\xbb"
+};
+
+#define COMMS_COUNT ((int) (sizeof(comms) / sizeof(comms[0])))
+
+// every MISSING_EVERY-th pid gets a directory without stat, as if the
+// process exited between readdir() and open()
+#define MISSING_EVERY 97
+
+#define MAX_COUNT 1000000
+#define MAX_REFRESHES 100000
+
+void bench_usage(int status) {
+    printf("Usage:\n ps_bench [options]\n\n");
+    fputs("Generates a synthetic proc tree and times ps scans over it.\n\n", stdout);
+    fputs(" -n, --count <N>       number of fake processes, at most 1000000 (default 100000)\n", stdout);
+    fputs(" -r, --refreshes <N>   number of watch refreshes (default 10)\n", stdout);
+    fputs(" -d, --dir <DIR>       where to create the tree (default a new /tmp dir)\n", stdout);
+    fputs(" -k, --keep            do not remove the tree on exit\n", stdout);
+    fputs(" --help                display this help and exit\n", stdout);
+    exit(status);
+}
+
+// parses a decimal number in [min, max] or exits with a message naming the option
+int parse_number(const char* value, long min, long max, const char* option) {
+    char* end;
+    errno = 0;
+    long num = strtol(value, &end, 10);
+    if (errno == ERANGE || end == value || *end != '\0' || num < min || num > max) {
+        printf("ps_bench: invalid %s value: %s (expected %ld..%ld)\n", option, value, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return (int) num;
+}
+
+// returns 0 on success, -1 with a message printed on failure
+int add_process(int root_fd, int pid) {
+    char name[32];
+    char path[64];
+    char buf[512];
+    snprintf(name, sizeof(name), "%d", pid);
+
+    if (mkdirat(root_fd, name, 0755) == -1) {
+        perror("ps_bench: mkdir");
+        return -1;
+    }
+    if (pid % MISSING_EVERY == 0) {
+        return 0;
+    }
+
+    // a quarter of the processes sit on a pts, the rest have no tty
+    long long tty = pid % 4 == 0 ? (136 << 8) | (pid % 16) : 0;
+    long long utime = (long long) pid * 7919 % 100003;
+    long long stime = (long long) pid * 104729 % 10007;
+    int len = snprintf(buf, sizeof(buf),
+                       "%d (%s) S 1 %d %d %lld -1 4194560 0 0 0 0 %lld %lld 0 0 20 0 1 0 0 0 0\n",
+                       pid, comms[pid % COMMS_COUNT], pid, pid, tty, utime, stime);
+
+    snprintf(path, sizeof(path), "%s/stat", name);
+    int fd = openat(root_fd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("ps_bench: stat");
+        return -1;
+    }
+    if (write(fd, buf, (size_t) len) != len) {
+        perror("ps_bench: stat");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+void remove_process(int root_fd, int pid) {
+    char name[32];
+    char path[64];
+    snprintf(name, sizeof(name), "%d", pid);
+    snprintf(path, sizeof(path), "%s/stat", name);
+    unlinkat(root_fd, path, 0);
+    unlinkat(root_fd, name, AT_REMOVEDIR);
+}
+
+int generate(int root_fd, int count) {
+    for (int pid = 1; pid <= count; ++pid) {
+        if (add_process(root_fd, pid) == -1) {
+            return -1;
+        }
+    }
+
+    // non-pid entries every real /proc has
+    mkdirat(root_fd, "sys", 0755);
+    mkdirat(root_fd, "self", 0755);
+    int fd = openat(root_fd, "meminfo", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1) {
+        close(fd);
+    }
+    return 0;
+}
+
+int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw) {
+    (void) sb;
+    (void) flag;
+    (void) ftw;
+    return remove(path);
+}
+
+// removes the generated tree unless --keep was given and exits with status
+void finish(const struct bench_params* bp, int root_fd, int status) {
+    close(root_fd);
+    if (!bp->keep) {
+        nftw(bp->root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    }
+    exit(status);
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// runs process() with stdout sent to /dev/null, returns wall time in seconds
+double run_scan(const struct opt_params* params) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    __real_close(null_fd);
+
+    double begin = now();
+    process(params);
+    fflush(stdout);
+    double elapsed = now() - begin;
+
+    dup2(saved, STDOUT_FILENO);
+    __real_close(saved);
+    return elapsed;
+}
+
+void report(const char* name, int entries, int scans, double seconds) {
+    double per = (double) entries * scans;
+    long long total = counters.openat + counters.read + counters.close + counters.fstatat + counters.readlink;
+
+    printf("%-22s %10.0f entries/s  %6.3f s  counted calls/process %5.2f"
+           "  (openat %.2f read %.2f close %.2f fstatat %.2f readlink %.2f)  readdir/process %.2f\n",
+           name, per / seconds, seconds / scans, total / per,
+           counters.openat / per, counters.read / per, counters.close / per,
+           counters.fstatat / per, counters.readlink / per, counters.readdir / per);
+}
+
+void bench(const char* name, const struct opt_params* params, int entries) {
+    memset(&counters, 0, sizeof(counters));
+    double seconds = run_scan(params);
+    report(name, entries, 1, seconds);
+}
+
+int main(int argc, char** argv) {
+    static struct option const long_opts[] = {
+            {"count",     required_argument, NULL, 'n'},
+            {"refreshes", required_argument, NULL, 'r'},
+            {"dir",       required_argument, NULL, 'd'},
+            {"keep",      no_argument,       NULL, 'k'},
+            {"help",      no_argument,       NULL, 'h'},
+            {NULL, 0,                        NULL, 0}
+    };
+
+    struct bench_params bp;
+    memset(&bp, 0, sizeof(bp));
+    bp.count = 100000;
+    bp.refreshes = 10;
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:r:d:kh", long_opts, NULL)) != -1) {
+        switch (c) {
+            case 'n':
+                bp.count = parse_number(optarg, 1, MAX_COUNT, "--count");
+                break;
+
+            case 'r':
+                bp.refreshes = parse_number(optarg, 0, MAX_REFRESHES, "--refreshes");
+                break;
+
+            case 'd':
+                snprintf(bp.root, sizeof(bp.root), "%s", optarg);
+                break;
+
+            case 'k':
+                bp.keep = 1;
+                break;
+
+            case 'h':
+                bench_usage(EXIT_SUCCESS);
+                break;
+
+            default:
+                bench_usage(EXIT_FAILURE);
+        }
+    }
+
+    if (bp.root[0] == '\0') {
+        strcpy(bp.root, "/tmp/ps_bench.XXXXXX");
+        if (!mkdtemp(bp.root)) {
+            perror("ps_bench: mkdtemp");
+            exit(EXIT_FAILURE);
+        }
+    } else if (mkdir(bp.root, 0755) == -1) {
+        perror("ps_bench: mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    int root_fd = open(bp.root, O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1) {
+        perror("ps_bench: open");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("generating %d processes in %s\n", bp.count, bp.root);
+    fflush(stdout);
+    double begin = now();
+    if (generate(root_fd, bp.count) == -1) {
+        finish(&bp, root_fd, EXIT_FAILURE);
+    }
+    printf("generated in %.2f s\n\n", now() - begin);
+    printf("counted calls are openat, read, close, fstatat and readlink made by ps itself;\n"
+           "opendir, getdents and stdout writes happen inside libc and are not counted\n\n");
+
+    char proc_root[PATH_MAX + 1];
+    snprintf(proc_root, sizeof(proc_root), "%s/", bp.root);
+
+    struct opt_params params;
+    memset(&params, 0, sizeof(params));
+    params.proc_root = proc_root;
+    params.all = 1;
+
+    // warm the dentry cache so the first scan is not penalised
+    run_scan(&params);
+
+    bench("full scan", &params, bp.count);
+
+    params.sort = SORT_TIME;
+    params.sort_desc = 1;
+    params.top = 20;
+    bench("full scan, top 20", &params, bp.count);
+
+    params.sort = SORT_NONE;
+    params.sort_desc = 0;
+    params.top = 0;
+    params.all = 0;
+
+    int pids[100];
+    for (int i = 0; i < 100; ++i) {
+        pids[i] = 1 + (int) ((long long) i * bp.count / 100);
+    }
+    params.pids = pids;
+    params.pids_count = 100;
+    bench("filter --pid (100)", &params, bp.count);
+    params.pids = NULL;
+    params.pids_count = 0;
+
+    params.filter_user = 1;
+    params.uid = getuid() + 1;
+    bench("filter --user (none)", &params, bp.count);
+    params.filter_user = 0;
+
+    params.comm = "bash";
+    bench("filter --comm", &params, bp.count);
+    params.comm = NULL;
+
+    // a watch refresh: 1% of the processes exit and as many new ones start,
+    // then the top 20 by cpu time are recomputed while another 0.5% exit
+    // between being listed and being read (and come back after the scan)
+    params.all = 1;
+    params.sort = SORT_TIME;
+    params.sort_desc = 1;
+    params.top = 20;
+
+    if (bp.refreshes) {
+        int churn = bp.count / 100 > 0 ? bp.count / 100 : 1;
+        int oldest = 1;
+        int next_pid = bp.count + 1;
+        double seconds = 0;
+        memset(&counters, 0, sizeof(counters));
+        for (int r = 0; r < bp.refreshes; ++r) {
+            struct syscall_counters saved = counters;
+            for (int i = 0; i < churn; ++i) {
+                remove_process(root_fd, oldest++);
+                if (add_process(root_fd, next_pid++) == -1) {
+                    finish(&bp, root_fd, EXIT_FAILURE);
+                }
+            }
+            counters = saved;
+
+            vanish_fd = root_fd;
+            vanish_phase = r % VANISH_EVERY;
+            vanish_seconds = 0;
+            seconds += run_scan(&params) - vanish_seconds;
+            vanish_fd = -1;
+
+            // bring the vanished processes back so every refresh scans bp.count entries
+            saved = counters;
+            for (size_t i = 0; i < vanished_count; ++i) {
+                if (add_process(root_fd, vanished_pids[i]) == -1) {
+                    finish(&bp, root_fd, EXIT_FAILURE);
+                }
+            }
+            vanished_count = 0;
+            counters = saved;
+        }
+        free(vanished_pids);
+        report("watch refresh, top 20", bp.count, bp.refreshes, seconds);
+        printf("%-22s %lld entries vanished during scans\n", "", vanished);
+    }
+
+    finish(&bp, root_fd, EXIT_SUCCESS);
+    return 0;
+}
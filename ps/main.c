@@ -1,17 +1,16 @@
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
-static struct option const long_opts[] = {
-        {"all",     no_argument, NULL, 'A'},
-        {"help",    no_argument, NULL, 'h'},
-        {"version", no_argument, NULL, 'v'},
-        {NULL, 0,                NULL, 0}
-};
+#include "ps.h"
 
 static struct option const terms[] = {
         {"mem",         no_argument, NULL, 1},
@@ -51,6 +50,15 @@ static struct option const terms[] = {
 
 void usage(int status) {
     printf("Usage:\n ps [options]\n\nBasic options:\n -A, -e               all processes\n");
+    fputs("\nSelection by list (a process matching any of them is shown):\n", stdout);
+    fputs(" -p, --pid <PID,...>  processes with the given ids\n", stdout);
+    fputs(" -u, --user <USER>    processes owned by user name or uid\n", stdout);
+    fputs(" -C, --comm <NAME>    processes with the given command name\n", stdout);
+    fputs("\nOutput ordering:\n", stdout);
+    fputs(" --sort <[+|-]KEY>    sort by pid, time or comm ('-' for descending)\n", stdout);
+    fputs(" --top <K>            print only the first K processes\n", stdout);
+    fputs("\nMiscellaneous options:\n", stdout);
+    fputs(" --proc-root <DIR>    read processes from DIR instead of /proc\n", stdout);
     fputs(" --help               display this help and exit\n", stdout);
     fputs(" --version            output version information and exit\n", stdout);
     fputs("ps 0.1\n", stdout);
@@ -70,14 +78,17 @@ void _version(int status) {
 
 void get_tty(char* path, char* out) {
     char fdpath[PATH_MAX];
-    fdpath[0] = '\0';
-    strcpy(fdpath, path);
-    strcat(fdpath, "/fd/0");
-
-    if (readlink(fdpath, out, PATH_MAX) == -1) {
+    ssize_t len = -1;
+    if (snprintf(fdpath, sizeof(fdpath), "%s/fd/0", path) < (int) sizeof(fdpath)) {
+        len = readlink(fdpath, out, PATH_MAX - 1);
+    }
+    if (len == -1) {
         strcpy(out, "?");
     } else {
-        strcpy(out, out + 5);
+        out[len] = '\0';
+        if (strncmp(out, "/dev/", 5) == 0) {
+            memmove(out, out + 5, (size_t) len - 4);
+        }
     }
 }
 
@@ -92,173 +103,448 @@ int get_tty_(int major, char* to) {
 }
 
 void get_cur_tty(char* start, char* cur_tty) {
-    int cur_pid = getpid();
     char cur_path[PATH_MAX];
-    strcpy(cur_path, start);
+    if (snprintf(cur_path, sizeof(cur_path), "%s%d", start, (int) getpid()) >= (int) sizeof(cur_path)) {
+        strcpy(cur_tty, "?");
+        return;
+    }
+    get_tty(cur_path, cur_tty);
+}
+
+// accepts only plain decimal numbers that fit in an int, returns -1 otherwise
+int parse_pid(const char* name) {
+    if (name[0] < '0' || name[0] > '9') {
+        return -1;
+    }
+    char* end;
+    errno = 0;
+    long num = strtol(name, &end, 10);
+    if (errno == ERANGE || *end != '\0' || num > INT_MAX) {
+        return -1;
+    }
+    return (int) num;
+}
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+// qsort has no context argument, so the ordering lives here
+static enum sort_key row_sort = SORT_PID;
+static int row_sort_desc = 0;
+
+int compare_rows(const void* a, const void* b) {
+    const struct proc_row* x = a;
+    const struct proc_row* y = b;
+    int res = 0;
+
+    switch (row_sort) {
+        case SORT_PID:
+            res = (x->pid > y->pid) - (x->pid < y->pid);
+            return row_sort_desc ? -res : res;
+        case SORT_TIME:
+            res = (x->ticks > y->ticks) - (x->ticks < y->ticks);
+            break;
+        case SORT_COMM:
+            res = strcmp(x->comm, y->comm);
+            break;
+        default:
+            break;
+    }
+    if (row_sort_desc) {
+        res = -res;
+    }
+    if (res == 0) {
+        res = (x->pid > y->pid) - (x->pid < y->pid);
+    }
+    return res;
+}
 
-    char t_path[PATH_MAX];
-    t_path[0] = '\0';
+void swap_rows(struct proc_row* a, struct proc_row* b) {
+    struct proc_row t = *a;
+    *a = *b;
+    *b = t;
+}
 
-    cur_tty[0] = '\0';
+// max-heap by compare_rows: the root is the row that would be printed last
+void heap_offer(struct proc_row* heap, size_t* size, size_t capacity, const struct proc_row* row) {
+    size_t i;
+    if (*size < capacity) {
+        i = (*size)++;
+        heap[i] = *row;
+        while (i > 0 && compare_rows(&heap[i], &heap[(i - 1) / 2]) > 0) {
+            swap_rows(&heap[i], &heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    if (compare_rows(row, &heap[0]) >= 0) {
+        return;
+    }
 
-    while (cur_pid > 0) {
-        char* s = malloc(2 * sizeof(char));
-        s[0] = (char) ('0' + cur_pid % 10);
-        s[1] = '\0';
-        strcat(t_path, s);
-        cur_pid /= 10;
-        free(s);
+    heap[0] = *row;
+    i = 0;
+    while (1) {
+        size_t largest = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < *size && compare_rows(&heap[left], &heap[largest]) > 0) {
+            largest = left;
+        }
+        if (right < *size && compare_rows(&heap[right], &heap[largest]) > 0) {
+            largest = right;
+        }
+        if (largest == i) {
+            break;
+        }
+        swap_rows(&heap[i], &heap[largest]);
+        i = largest;
     }
-    int iter = 0;
+}
 
-    int length = (int) strlen(t_path);
-    while (iter < length - iter - 1) {
-        char t = t_path[iter];
-        t_path[iter] = t_path[length - iter - 1];
-        t_path[length - iter - 1] = t;
-        ++iter;
+// doubles the row buffer, but never past limit (0 - no limit)
+struct proc_row* grow_rows(struct proc_row* rows, size_t* capacity, size_t limit) {
+    size_t wanted = *capacity ? 2 * *capacity : 256;
+    if (limit && wanted > limit) {
+        wanted = limit;
     }
-    strcat(cur_path, t_path);
-    get_tty(cur_path, cur_tty);
+    struct proc_row* grown = realloc(rows, wanted * sizeof(struct proc_row));
+    if (!grown) {
+        printf("ps: memory exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    *capacity = wanted;
+    return grown;
 }
 
-int process(int all) {
+// reads pid, comm, tty and cpu time from <dir_fd>/<name>/stat with a single read
+int read_stat(int dir_fd, const char* name, struct proc_row* row) {
+    char path[NAME_MAX + 8];
+    char buf[1024];
+    snprintf(path, sizeof(path), "%s/stat", name);
+
+    int fd = openat(dir_fd, path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    // comm may contain spaces and parentheses, so it spans up to the last ')'
+    char* comm_begin = strchr(buf, '(');
+    char* comm_end = strrchr(buf, ')');
+    if (!comm_begin || !comm_end || comm_end < comm_begin) {
+        return 0;
+    }
+    size_t comm_len = (size_t) (comm_end - comm_begin - 1);
+    if (comm_len > NAME_MAX) {
+        comm_len = NAME_MAX;
+    }
+    memcpy(row->comm, comm_begin + 1, comm_len);
+    row->comm[comm_len] = '\0';
+
+    char state;
+    long long utime = 0;
+    long long stime = 0;
+    if (sscanf(comm_end + 1, " %c %*d %*d %*d %lld %*d %*u %*u %*u %*u %*u %lld %lld",
+               &state, &row->tty, &utime, &stime) != 4) {
+        return 0;
+    }
+    row->ticks = utime + stime;
+    return 1;
+}
+
+void print_row(const struct proc_row* row, const char* start, const char* cur_tty) {
+    static long clk = 0;
+    if (clk == 0) {
+        clk = sysconf(_SC_CLK_TCK);
+    }
+
+    long long days = row->ticks / 3600 / 24 / clk;
+    long long hours = (row->ticks / 3600 / clk) % 24;
+    long long minutes = (row->ticks / 60 / clk) % 60;
+    long long seconds = (row->ticks / clk) % 60;
+
+    unsigned long long tty = (unsigned long long) row->tty;
+    char ttt[PATH_MAX];
+
+    if (major(tty) == 0) {
+        strcpy(ttt, "?");
+    } else if (get_tty_(major(tty), ttt)) {
+        sprintf(ttt + strlen(ttt), "/%u", minor(tty));
+    } else {
+        char p_path[PATH_MAX];
+        if (snprintf(p_path, sizeof(p_path), "%s%d", start, row->pid) < (int) sizeof(p_path)) {
+            get_tty(p_path, ttt);
+        } else {
+            strcpy(ttt, "?");
+        }
+        if (strlen(ttt) > strlen(cur_tty)) {
+            ttt[strlen(cur_tty)] = '\0';
+        }
+    }
+
+    printf("%d\t %s\t %lld:%lld%lld:%lld%lld:%lld%lld\t %s\n", row->pid, ttt, days, hours / 10,
+           hours % 10, minutes / 10, minutes % 10, seconds / 10, seconds % 10, row->comm);
+}
+
+int process(const struct opt_params* params) {
     printf("PID\t TTY\t TIME\t CMD\t\n");
-    char* start = "/proc/";
-    char* add = "/stat";
+    char* start = params->proc_root;
 
     char cur_tty[PATH_MAX];
     char p_path[PATH_MAX];
     char p_tty[PATH_MAX];
 
+    // as in procps, -p, -u and -C select the union of their matches and
+    // replace the default "my processes on my tty" selection, -A selects all
+    int by_list = !params->all && (params->pids_count || params->filter_user || params->comm);
+    int by_default = !params->all && !by_list;
+
+    row_sort = params->sort;
+    row_sort_desc = params->sort_desc;
+
+    // rows are only buffered when they have to be sorted, with --top the
+    // buffer grows up to K rows and then works as a heap
+    struct proc_row* rows = NULL;
+    size_t rows_count = 0;
+    size_t rows_capacity = 0;
+    size_t printed = 0;
+
     get_cur_tty(start, cur_tty);
     DIR* dir = opendir(start);
     if (dir) {
+        int dir_fd = dirfd(dir);
         struct dirent* ent;
         while ((ent = readdir(dir)) != NULL) {
-            p_tty[0] = '\0';
-            p_path[0] = '\0';
-
-            char* dest = ent->d_name;
-            int num = 0;
-            for (int i = 0; i < strlen(dest); ++i) {
-                if ((int) (dest[i]) - '0' > 9 || (int) (dest[i]) - '0' < 0) {
-                    num = -1;
-                    break;
-                }
-                num = num * 10 + ((int) dest[i] - '0');
-            }
-
+            int num = parse_pid(ent->d_name);
             if (num == -1) {
                 continue;
             }
 
-            size_t len_start = strlen(start);
-            size_t len_file = strlen(dest);
-            char* new_dest = (char*) malloc((len_start + len_file + 11) * sizeof(char));
-
-            for (int k = 0; k < len_start; ++k) {
-                new_dest[k] = start[k];
-            }
-            for (int k = 0; k < len_file; ++k) {
-                new_dest[k + len_start] = dest[k];
-            }
-            for (int k = 0; k < 5; ++k) {
-                new_dest[k + len_file + len_start] = add[k];
+            // cheap checks go first, a process matched by one of them needs no more
+            int matched = !by_list;
+            if (by_list && params->pids_count) {
+                matched = bsearch(&num, params->pids, params->pids_count, sizeof(int), compare_ints) != NULL;
             }
 
-            FILE* stats = fopen(new_dest, "r");
-            if (!stat) {
-                printf("%d\t ?\t 0:00:00:00\t ?\n", num);
-            } else {
-                int pid = num;
-                char comm[NAME_MAX];
-                long long utime = 0;
-                long long stime = 0;
-                long long tty = 0;
-                char trash[3 * NAME_MAX];
-                for (int i = 0; i < 14; ++i) {
-                    if (i == 0) {
-                        fscanf(stats, "%d", &pid);
-                    } else if (i == 1) {
-                        fscanf(stats, "%s", comm);
-                    } else if (i == 6) {
-                        fscanf(stats, "%lld", &tty);
-                    } else if (i == 13) {
-                        fscanf(stats, "%lld %lld", &utime, &stime);
-                    } else {
-                        fscanf(stats, "%s", trash);
-                    }
+            if (by_default || (!matched && params->filter_user)) {
+                uid_t uid = by_default ? getuid() : params->uid;
+                struct stat session;
+                if (fstatat(dir_fd, ent->d_name, &session, 0) == -1) {
+                    continue;
                 }
+                if (session.st_uid == uid) {
+                    matched = 1;
+                } else if (by_default) {
+                    continue;
+                }
+            }
+
+            if (!matched && !params->comm) {
+                continue;
+            }
 
-                comm[strlen(comm) - 1] = '\0';
-                long long days = (utime + stime) / 3600 / 24 / sysconf(_SC_CLK_TCK);
-                long long hours = ((utime + stime) / 3600 / sysconf(_SC_CLK_TCK)) % 24;
-                long long minutes = ((utime + stime) / 60 / sysconf(_SC_CLK_TCK)) % 60;
-                long long seconds = ((utime + stime) / sysconf(_SC_CLK_TCK)) % 60;
+            // the process may have exited since readdir, such entries are skipped
+            struct proc_row row;
+            row.pid = num;
+            if (!read_stat(dir_fd, ent->d_name, &row)) {
+                continue;
+            }
 
-                struct stat session;
-                stat(new_dest, &session);
+            if (!matched && strcmp(params->comm, row.comm) != 0) {
+                continue;
+            }
 
-                if (session.st_uid != getuid() && !all) {
-                    fclose(stats);
-                    free(new_dest);
+            if (by_default) {
+                if (snprintf(p_path, sizeof(p_path), "%s%s", start, ent->d_name) >= (int) sizeof(p_path)) {
                     continue;
                 }
-
-                p_tty[0] = '\0';
-                strcpy(p_path, start);
-                strcat(p_path, dest);
                 get_tty(p_path, p_tty);
-                p_tty[strlen(p_tty) - (strlen(p_tty) - strlen(cur_tty))] = '\0';
+                if (strlen(p_tty) > strlen(cur_tty)) {
+                    p_tty[strlen(cur_tty)] = '\0';
+                }
 
-                if (strcmp(cur_tty, p_tty) != 0 && !all) {
-                    fclose(stats);
-                    free(new_dest);
+                if (strcmp(cur_tty, p_tty) != 0) {
                     continue;
                 }
+            }
 
-                char ttt[PATH_MAX];
-                int ret = get_tty_(major((unsigned long long) tty), ttt);
-
-                if (major((unsigned long long) tty) == 0) {
-                    printf("%d\t ?\t %lld:%lld%lld:%lld%lld:%lld%lld\t %s\n", pid, days, hours / 10,
-                           hours % 10, minutes / 10, minutes % 10, seconds / 10, seconds % 10, comm + 1);
+            if (params->sort == SORT_NONE) {
+                print_row(&row, start, cur_tty);
+                if (params->top && ++printed == params->top) {
+                    break;
+                }
+            } else {
+                if (rows_count == rows_capacity && (!params->top || rows_capacity < params->top)) {
+                    rows = grow_rows(rows, &rows_capacity, params->top);
+                }
+                if (params->top) {
+                    heap_offer(rows, &rows_count, params->top, &row);
                 } else {
-                    if (ret) {
-                        printf("%d\t %s/%d\t %lld:%lld%lld:%lld%lld:%lld%lld\t %s\n", pid, ttt,
-                               minor((unsigned long long) tty), days, hours / 10,
-                               hours % 10,
-                               minutes / 10, minutes % 10, seconds / 10, seconds % 10, comm + 1);
-                    } else {
-                        printf("%d\t %s\t %lld:%lld%lld:%lld%lld:%lld%lld\t %s\n", pid, p_tty, days, hours / 10,
-                               hours % 10,
-                               minutes / 10, minutes % 10, seconds / 10, seconds % 10, comm + 1);
-                    }
+                    rows[rows_count++] = row;
                 }
-                fclose(stats);
             }
-            free(new_dest);
         }
         closedir(dir);
     } else {
         printf("Unknown error.");
         exit(EXIT_FAILURE);
     }
-    return 0;
+
+    if (rows_count) {
+        qsort(rows, rows_count, sizeof(struct proc_row), compare_rows);
+        for (size_t i = 0; i < rows_count; ++i) {
+            print_row(&rows[i], start, cur_tty);
+        }
+    }
+    free(rows);
+    return 1;
 }
 
+void add_pids(struct opt_params* params, char* list) {
+    for (char* item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        int pid = parse_pid(item);
+        if (pid == -1) {
+            printf("ps: invalid process id: %s\n", item);
+            usage(EXIT_FAILURE);
+        }
+        int* grown = realloc(params->pids, (params->pids_count + 1) * sizeof(int));
+        if (!grown) {
+            printf("ps: memory exhausted\n");
+            exit(EXIT_FAILURE);
+        }
+        params->pids = grown;
+        params->pids[params->pids_count++] = pid;
+    }
+}
+
+void set_user(struct opt_params* params, const char* user) {
+    int uid = parse_pid(user);
+    if (uid == -1 && user[0] != '\0' && strspn(user, "0123456789") == strlen(user)) {
+        printf("ps: invalid user id: %s\n", user);
+        usage(EXIT_FAILURE);
+    }
+    if (uid == -1) {
+        struct passwd* pw = getpwnam(user);
+        if (!pw) {
+            printf("ps: user name does not exist: %s\n", user);
+            usage(EXIT_FAILURE);
+        }
+        params->uid = pw->pw_uid;
+    } else {
+        params->uid = (uid_t) uid;
+    }
+    params->filter_user = 1;
+}
+
+void set_sort(struct opt_params* params, const char* key) {
+    params->sort_desc = 0;
+    if (key[0] == '-' || key[0] == '+') {
+        params->sort_desc = key[0] == '-';
+        ++key;
+    }
+
+    if (strcmp(key, "pid") == 0) {
+        params->sort = SORT_PID;
+    } else if (strcmp(key, "time") == 0) {
+        params->sort = SORT_TIME;
+    } else if (strcmp(key, "comm") == 0) {
+        params->sort = SORT_COMM;
+    } else {
+        printf("ps: unknown sort key: %s\n", key);
+        usage(EXIT_FAILURE);
+    }
+}
+
+void set_top(struct opt_params* params, const char* value) {
+    int top = parse_pid(value);
+    if (top <= 0) {
+        printf("ps: invalid --top value: %s\n", value);
+        usage(EXIT_FAILURE);
+    }
+    params->top = (size_t) top;
+}
+
+// the root must leave room for "/<pid>/fd/0" within PATH_MAX
+#define PROC_ROOT_MAX (PATH_MAX - (int) sizeof("/2147483647/fd/0"))
+
+void set_proc_root(struct opt_params* params, const char* root) {
+    size_t len = strlen(root);
+    if (len == 0) {
+        printf("ps: --proc-root must not be empty\n");
+        usage(EXIT_FAILURE);
+    }
+    if (len > PROC_ROOT_MAX) {
+        printf("ps: --proc-root is longer than %d characters\n", PROC_ROOT_MAX);
+        usage(EXIT_FAILURE);
+    }
+
+    free(params->proc_root);
+    params->proc_root = malloc(len + 2);
+    if (!params->proc_root) {
+        printf("ps: memory exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(params->proc_root, len + 2, "%s%s", root, root[len - 1] == '/' ? "" : "/");
+}
+
+#ifndef PS_NO_MAIN
+static struct option const long_opts[] = {
+        {"all",       no_argument,       NULL, 'A'},
+        {"pid",       required_argument, NULL, 'p'},
+        {"user",      required_argument, NULL, 'u'},
+        {"comm",      required_argument, NULL, 'C'},
+        {"sort",      required_argument, NULL, 'S'},
+        {"top",       required_argument, NULL, 'T'},
+        {"proc-root", required_argument, NULL, 'R'},
+        {"help",      no_argument,       NULL, 'h'},
+        {"version",   no_argument,       NULL, 'v'},
+        {NULL, 0,                        NULL, 0}
+};
+
 int main(int argc, char** argv) {
     int c;
-    int all = 0;
     int help = 0;
     int version = 0;
+    struct opt_params params;
+    memset(&params, 0, sizeof(params));
 
-    while ((c = getopt_long(argc, argv, "hveA", long_opts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hveAp:u:C:", long_opts, NULL)) != -1) {
         switch (c) {
             case 'A':
             case 'e':
-                all = 1;
+                params.all = 1;
+                break;
+
+            case 'p':
+                add_pids(&params, optarg);
+                break;
+
+            case 'u':
+                set_user(&params, optarg);
+                break;
+
+            case 'C':
+                params.comm = optarg;
+                break;
+
+            case 'S':
+                set_sort(&params, optarg);
+                break;
+
+            case 'T':
+                set_top(&params, optarg);
+                break;
+
+            case 'R':
+                set_proc_root(&params, optarg);
                 break;
 
             case 'h':
@@ -282,7 +568,18 @@ int main(int argc, char** argv) {
         _version(EXIT_SUCCESS);
     }
 
-    int status = process(all);
+    if (!params.proc_root) {
+        set_proc_root(&params, DEFAULT_PROC_ROOT);
+    }
+
+    if (params.pids_count) {
+        qsort(params.pids, params.pids_count, sizeof(int), compare_ints);
+    }
+
+    int status = process(&params);
+    free(params.pids);
+    free(params.proc_root);
 
     exit(status ? EXIT_SUCCESS : EXIT_FAILURE);
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,39 @@
+#ifndef PS_H
+#define PS_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DEFAULT_PROC_ROOT "/proc/"
+
+enum sort_key {
+    SORT_NONE,
+    SORT_PID,
+    SORT_TIME,
+    SORT_COMM
+};
+
+struct opt_params {
+    char* proc_root; // always ends with '/'
+    int all;
+    int* pids; // sorted, searched with bsearch
+    size_t pids_count;
+    int filter_user;
+    uid_t uid;
+    char* comm;
+    enum sort_key sort;
+    int sort_desc;
+    size_t top; // 0 - no limit
+};
+
+struct proc_row {
+    int pid;
+    long long tty;
+    long long ticks;
+    char comm[NAME_MAX + 1];
+};
+
+int process(const struct opt_params* params);
+
+#endif